@@ -0,0 +1,88 @@
+//
+// bench_util.hpp
+// ~~~~~~~~~~~~~~
+
+
+#ifndef BENCH_UTIL_HPP
+#define BENCH_UTIL_HPP
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <streambuf>
+#include <string>
+
+// chat_message logs every encode and decode to std::cout. Benchmarks and the
+// fuzz harness swap in a buffer that drops the text, so the formatting cost is
+// still measured but the terminal is not.
+class silence_cout {
+public:
+    silence_cout()
+        : old_(std::cout.rdbuf(&null_)) {
+    }
+
+    ~silence_cout() {
+        std::cout.rdbuf(old_);
+    }
+
+    silence_cout(const silence_cout&) = delete;
+    silence_cout& operator=(const silence_cout&) = delete;
+
+private:
+    class null_buffer : public std::streambuf {
+    protected:
+        int overflow(int c) override { return c; }
+        std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+    };
+
+    null_buffer null_;
+    std::streambuf* old_;
+};
+
+// Generated files go into a directory of their own that is removed when the
+// benchmark exits; at 10M messages they take hundreds of MB.
+class bench_directory {
+public:
+    bench_directory()
+        : path_(std::filesystem::temp_directory_path() / ("kurakani_bench_" + std::to_string(std::random_device()()))) {
+        std::filesystem::create_directories(path_);
+    }
+
+    ~bench_directory() {
+        std::error_code ec;
+        std::filesystem::remove_all(path_, ec);
+    }
+
+    const std::filesystem::path& path() const {
+        return path_;
+    }
+
+private:
+    std::filesystem::path path_;
+};
+
+inline std::string bench_file(const std::string& name) {
+    static bench_directory directory;
+    return (directory.path() / name).string();
+}
+
+// Writes users.txt / messages.txt style files in the format Database loads.
+// Messages are spread round-robin over conversations between users 1..users.
+inline void write_bench_files(const std::string& user_file, const std::string& message_file,
+                              std::uint64_t users, std::uint64_t messages) {
+    std::ofstream user_out(user_file);
+    for (std::uint64_t id = 1; id <= users; ++id) {
+        user_out << id << " user" << id << " password\n";
+    }
+
+    std::ofstream message_out(message_file);
+    for (std::uint64_t i = 0; i < messages; ++i) {
+        std::uint64_t sender = i % users + 1;
+        std::uint64_t receiver = (i + 1) % users + 1;
+        message_out << sender << " " << receiver << " benchmark message number " << i << "\n";
+    }
+}
+
+#endif // BENCH_UTIL_HPP
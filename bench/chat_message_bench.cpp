@@ -0,0 +1,45 @@
+#include <benchmark/benchmark.h>
+#include <cstring>
+#include <string>
+#include "../chat_message.hpp"
+#include "bench_util.hpp"
+
+static void BM_encode_header(benchmark::State& state) {
+    silence_cout quiet;
+    chat_message msg;
+    std::string body(static_cast<std::size_t>(state.range(0)), 'x');
+    msg.body_length(body.size());
+    std::memcpy(msg.body(), body.data(), msg.body_length());
+    std::uint64_t sequence = 0;
+    for (auto _ : state) {
+        msg.encode_header("#S_M", 1700000000000ull, 1700000000001ull, ++sequence);
+        benchmark::DoNotOptimize(msg.data());
+    }
+    state.SetBytesProcessed(state.iterations() * chat_message::header_length);
+}
+BENCHMARK(BM_encode_header)->Arg(0)->Arg(chat_message::max_body_length);
+
+static void BM_decode_header(benchmark::State& state) {
+    silence_cout quiet;
+    chat_message encoded;
+    encoded.body_length(64);
+    encoded.encode_header("#S_M", 1700000000000ull, 1700000000001ull, 42);
+
+    chat_message msg;
+    for (auto _ : state) {
+        std::memcpy(msg.data(), encoded.data(), chat_message::header_length);
+        benchmark::DoNotOptimize(msg.decode_header());
+    }
+    state.SetBytesProcessed(state.iterations() * chat_message::header_length);
+}
+BENCHMARK(BM_decode_header);
+
+static void BM_decode_header_invalid(benchmark::State& state) {
+    silence_cout quiet;
+    chat_message msg;
+    std::memset(msg.data(), '?', chat_message::header_length);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(msg.decode_header());
+    }
+}
+BENCHMARK(BM_decode_header_invalid);
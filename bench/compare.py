@@ -0,0 +1,50 @@
+#!/usr/bin/env python3
+"""Compare two Google Benchmark JSON result files.
+
+    python3 bench/compare.py bench/results/baseline.json bench/results/latest.json
+
+Prints the real time of every benchmark found in both files and the change
+relative to the baseline. Exits with 1 if any benchmark got slower than the
+--threshold (default 10%).
+"""
+
+import argparse
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        results = json.load(f)
+    times = {}
+    for run in results["benchmarks"]:
+        if run.get("run_type", "iteration") == "iteration":
+            times[run["name"]] = (run["real_time"], run["time_unit"])
+    return times
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("baseline")
+    parser.add_argument("contender")
+    parser.add_argument("--threshold", type=float, default=0.10)
+    args = parser.parse_args()
+
+    baseline = load(args.baseline)
+    contender = load(args.contender)
+
+    regressed = False
+    print(f"{'benchmark':<48} {'baseline':>14} {'contender':>14} {'change':>8}")
+    for name, (old, unit) in baseline.items():
+        if name not in contender:
+            continue
+        new, _ = contender[name]
+        change = (new - old) / old if old else 0.0
+        marker = " <-" if change > args.threshold else ""
+        regressed |= change > args.threshold
+        print(f"{name:<48} {old:>11.1f} {unit:<2} {new:>11.1f} {unit:<2} {change:>+7.1%}{marker}")
+    return 1 if regressed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
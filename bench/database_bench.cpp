@@ -0,0 +1,78 @@
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <string>
+#include "../database.hpp"
+#include "bench_util.hpp"
+
+namespace {
+
+const std::uint64_t conversation_users = 100;
+
+std::unique_ptr<Database> fresh_database(const std::string& name, std::uint64_t messages) {
+    std::string tag = name + "_" + std::to_string(messages);
+    std::string user_file = bench_file("users_" + tag + ".txt");
+    std::string message_file = bench_file("messages_" + tag + ".txt");
+    write_bench_files(user_file, message_file, conversation_users, messages);
+    std::filesystem::remove(message_file + ".seq");
+    std::filesystem::remove(message_file + ".read");
+    return std::make_unique<Database>(user_file, message_file);
+}
+
+// Databases are expensive to build at 10M messages, so the ones that are only
+// read are loaded once per size and shared.
+Database& shared_database(std::uint64_t messages) {
+    static std::map<std::uint64_t, std::unique_ptr<Database>> databases;
+    auto& db = databases[messages];
+    if (!db) {
+        db = fresh_database("read", messages);
+    }
+    return *db;
+}
+
+} // namespace
+
+// Every add grows the database, so it is rebuilt (untimed) once it has grown
+// by a tenth, keeping each size within 10% of its nominal message count.
+static void BM_add_message(benchmark::State& state) {
+    const std::uint64_t messages = state.range(0);
+    const std::uint64_t max_growth = std::max<std::uint64_t>(messages / 10, 1);
+    std::unique_ptr<Database> db = fresh_database("write", messages);
+    std::uint64_t added = 0;
+    for (auto _ : state) {
+        if (added == max_growth) {
+            state.PauseTiming();
+            db.reset();
+            db = fresh_database("write", messages);
+            added = 0;
+            state.ResumeTiming();
+        }
+        benchmark::DoNotOptimize(db->add_message(1, 2, "benchmark message"));
+        ++added;
+    }
+}
+BENCHMARK(BM_add_message)->Arg(1000)->Arg(1000000)->Arg(10000000)->Iterations(10000)->Unit(benchmark::kMicrosecond);
+
+static void BM_get_messages(benchmark::State& state) {
+    Database& db = shared_database(state.range(0));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.get_messages(1, 2));
+    }
+}
+BENCHMARK(BM_get_messages)->Arg(1000)->Arg(1000000)->Arg(10000000)->Unit(benchmark::kMillisecond);
+
+// get_all_users copies the user table, so it scales with users, not messages.
+static void BM_get_all_users(benchmark::State& state) {
+    std::string tag = std::to_string(state.range(0));
+    std::string user_file = bench_file("users_only_" + tag + ".txt");
+    std::string message_file = bench_file("no_messages_" + tag + ".txt");
+    write_bench_files(user_file, message_file, state.range(0), 0);
+    Database db(user_file, message_file);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(db.get_all_users());
+    }
+}
+BENCHMARK(BM_get_all_users)->Arg(1000)->Arg(100000)->Arg(1000000)->Unit(benchmark::kMicrosecond);
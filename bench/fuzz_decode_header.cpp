@@ -0,0 +1,70 @@
+// Fuzz harness for chat_message::decode_header.
+//
+// Built against libFuzzer when the compiler supports -fsanitize=fuzzer
+// (KURAKANI_LIBFUZZER is then defined). Otherwise a small driver feeds it
+// random and mutated headers, or the files given on the command line.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <vector>
+#include "../chat_message.hpp"
+#include "bench_util.hpp"
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t* data, std::size_t size) {
+    silence_cout quiet;
+    chat_message msg;
+    std::memset(msg.data(), 0, chat_message::header_length);
+    std::memcpy(msg.data(), data, std::min<std::size_t>(size, chat_message::header_length));
+
+    if (msg.decode_header()) {
+        if (msg.body_length() > chat_message::max_body_length || msg.get_message_id().size() > 4) {
+            std::abort();
+        }
+    }
+    else if (msg.body_length() != 0) {
+        std::abort(); // a rejected header must not leave a body length behind
+    }
+    return 0;
+}
+
+#ifndef KURAKANI_LIBFUZZER
+int main(int argc, char* argv[]) {
+    if (argc > 1) {
+        for (int i = 1; i < argc; ++i) {
+            std::ifstream file(argv[i], std::ios::binary);
+            std::vector<char> input((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            LLVMFuzzerTestOneInput(reinterpret_cast<const std::uint8_t*>(input.data()), input.size());
+        }
+        return 0;
+    }
+
+    chat_message seed;
+    {
+        silence_cout quiet;
+        seed.body_length(12);
+        seed.encode_header("#S_M", 1700000000000ull, 1700000000001ull, 7);
+    }
+
+    std::mt19937_64 random(12345);
+    std::vector<std::uint8_t> input(chat_message::header_length);
+    const char alphabet[] = "0123456789 -+#SMREGLOCAKU_\t\n%\xff";
+    for (int run = 0; run < 200000; ++run) {
+        if (run % 2 == 0) {
+            for (auto& byte : input) byte = static_cast<std::uint8_t>(random());
+        }
+        else {
+            std::memcpy(input.data(), seed.data(), input.size());
+            for (int flips = 1 + random() % 4; flips > 0; --flips) {
+                input[random() % input.size()] = alphabet[random() % (sizeof(alphabet) - 1)];
+            }
+        }
+        LLVMFuzzerTestOneInput(input.data(), random() % (input.size() + 1));
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,68 @@
+#include <benchmark/benchmark.h>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Same container as the server's sessions_ map. Client IDs are millisecond
+// timestamps, so the keys are generated the same way.
+struct session_stub {
+    std::uint64_t id;
+};
+
+using session_map = std::unordered_map<std::uint64_t, std::shared_ptr<session_stub>>;
+
+static std::vector<std::uint64_t> client_ids(std::size_t count) {
+    std::vector<std::uint64_t> ids;
+    std::uint64_t now = 1700000000000ull;
+    for (std::size_t i = 0; i < count; ++i) {
+        now += 1 + (i * 7919) % 13; // registrations a few ms apart
+        ids.push_back(now);
+    }
+    return ids;
+}
+
+static void BM_session_lookup_hit(benchmark::State& state) {
+    auto ids = client_ids(state.range(0));
+    session_map sessions;
+    for (auto id : ids) {
+        sessions[id] = std::make_shared<session_stub>(session_stub{ id });
+    }
+    std::size_t i = 0;
+    for (auto _ : state) {
+        auto it = sessions.find(ids[i]);
+        benchmark::DoNotOptimize(it);
+        if (++i == ids.size()) i = 0;
+    }
+}
+BENCHMARK(BM_session_lookup_hit)->Arg(1000)->Arg(100000);
+
+static void BM_session_lookup_miss(benchmark::State& state) {
+    auto ids = client_ids(state.range(0));
+    session_map sessions;
+    for (auto id : ids) {
+        sessions[id] = std::make_shared<session_stub>(session_stub{ id });
+    }
+    std::uint64_t missing = ids.back();
+    for (auto _ : state) {
+        auto it = sessions.find(++missing);
+        benchmark::DoNotOptimize(it);
+    }
+}
+BENCHMARK(BM_session_lookup_miss)->Arg(1000)->Arg(100000);
+
+// Login and disconnect: one insert and one erase against a populated map.
+static void BM_session_insert_erase(benchmark::State& state) {
+    auto ids = client_ids(state.range(0));
+    session_map sessions;
+    for (auto id : ids) {
+        sessions[id] = std::make_shared<session_stub>(session_stub{ id });
+    }
+    auto session = std::make_shared<session_stub>(session_stub{ 0 });
+    std::uint64_t id = ids.back();
+    for (auto _ : state) {
+        sessions[++id] = session;
+        sessions.erase(id);
+    }
+}
+BENCHMARK(BM_session_insert_erase)->Arg(1000)->Arg(100000);
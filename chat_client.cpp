@@ -1,13 +1,17 @@
 #include <cstdlib>
 #include<stdio.h>
-#include<conio.h>
 #include <deque>
+#include <unordered_map>
 #include <iostream>
 #include <chrono>
+#include <random>
 #include <string>
 #include <thread>
+#include <utility>
 #include <boost/asio.hpp>
 #include "chat_message.hpp"
+#include "frame_buffer.hpp"
+#include "socket_options.hpp"
 
 using tcp = boost::asio::ip::tcp;
 class chat_client;
@@ -19,25 +23,48 @@ void message(chat_client& c, std::string message_id, std::string line, std::uint
 
 class chat_client {
 public:
-    chat_client(boost::asio::io_context& io_context, const tcp::resolver::results_type& endpoints)
-        : io_context_(io_context), socket_(io_context), registered_(false) {
+    chat_client(boost::asio::io_context& io_context, const tcp::resolver::results_type& endpoints, const socket_options& options)
+        : io_context_(io_context), socket_(io_context), retransmit_timer_(io_context), options_(options),
+          read_buffer_(options.read_buffer_size), next_sequence_(1), sequence_known_(false),
+          instance_(generate_instance()), registered_(false) {
         generate_unique_id(); // Generate unique ID
         do_connect(endpoints);
     }
 
-    void write(const chat_message& msg) {
+    // #S_M frames are numbered here and kept until the server acks them, so
+    // any number of them can be in flight at once. Until the login or
+    // registration reply says where numbering continues they are held back.
+    void write(chat_message msg) {
         boost::asio::post(io_context_,
-            [this, msg]() {
-                bool write_in_progress = !write_msgs_.empty();
-                write_msgs_.push_back(msg);
-                if (!write_in_progress) {
-                    do_write();
+            [this, msg]() mutable {
+                if (msg.get_message_id() != "#S_M") {
+                    queue_write(msg);
                 }
+                else if (!sequence_known_) {
+                    held_msgs_.push_back(msg);
+                }
+                else {
+                    send_sequenced(msg);
+                }
+            });
+    }
+
+    // Sends a read receipt for everything seen so far from the current
+    // chat partner.
+    void mark_read() {
+        boost::asio::post(io_context_,
+            [this]() {
+                chat_message msg;
+                msg.encode_header("#R_R", id_, reciever_id_, last_seen_[reciever_id_]);
+                queue_write(msg);
             });
     }
 
     void close() {
-        boost::asio::post(io_context_, [this]() { socket_.close(); });
+        boost::asio::post(io_context_, [this]() {
+            socket_.close();
+            retransmit_timer_.cancel();
+        });
     }
 
     std::uint64_t getid_() {
@@ -56,6 +83,7 @@ private:
         boost::asio::async_connect(socket_, endpoints,
             [this](boost::system::error_code ec, tcp::endpoint) {
                 if (!ec) {
+                    options_.apply(socket_);
                     std::cout << "Connected to server.\n";
                     ask_initial_option();
                 }
@@ -103,14 +131,14 @@ private:
         std::getline(std::cin, password);
 
         chat_message msg;
-        std::string login_info = std::to_string(login_id) + ":" + password;
+        std::string login_info = std::to_string(login_id) + ":" + password + ":" + std::to_string(instance_);
         msg.body_length(login_info.size());
         std::memcpy(msg.body(), login_info.c_str(), msg.body_length());
         msg.encode_header("#LOG", id_);
         write(msg);
 
         registered_ = true;
-        do_read_header();
+        do_read();
     }
 
     void ask_name() {
@@ -129,7 +157,7 @@ private:
 
     void send_registration() {
         chat_message msg;
-        std::string registration_info = name_ + ":" + password_;
+        std::string registration_info = name_ + ":" + password_ + ":" + std::to_string(instance_);
         msg.body_length(registration_info.size());
         std::memcpy(msg.body(), registration_info.c_str(), msg.body_length());
         msg.encode_header("#REG", id_);
@@ -138,93 +166,126 @@ private:
         registered_ = true;
         std::cout << "Registration sent to server.\n";
 
-        do_read_header();
+        do_read();
     }
 
-    void do_read_header() {
-        boost::asio::async_read(socket_,
-            boost::asio::buffer(read_msg_.data(), chat_message::header_length),
-            [this](boost::system::error_code ec, std::size_t /*length*/) {
-                if (!ec && read_msg_.decode_header()) {
-                    if (read_msg_.get_message_id() == "#REG" || read_msg_.get_message_id() == "#S_C") {
-                        do_read_body();
-                    }
-                    else if (read_msg_.get_message_id() == "#C_C") {
-                        std::uint64_t reciever = read_msg_.get_sender_id();
-                        char decesion;
-                        bool f = true;
-                        while (f == true) {
-
-                            std::cout << "Do you want to chat with " << reciever << "? (y/n)";
-                            std::cin >> decesion;
-                            if (decesion == 'y') {
-                                message(*this, "#C_A", "Chat request accepted", reciever);
-                                std::cout << "Chat request accepted.\n";
-                                reciever_id_ = reciever;
-                                f = false;
-
-                            }
-                            else if (decesion == 'n') {
-                                message(*this, "#C_D", "Chat request denied", reciever);
-                                std::cout << "Chat request denied.\n";
-                                f = false;
-                            }
-                            else {
-                                std::cout << "Invalid input. Please enter 'y' or 'n'." << std::endl;
-                            }
-                        }
-                        do_read_header();
-                    }
-                    else if (read_msg_.get_message_id() == "#S_M") {
-                        if (read_msg_.get_sender_id() == reciever_id_) {
-                            do_read_body();
-                        }
-                        else {
-                            std::cout << "Message from unknown sender\n";
-                            read_msg_ = chat_message(); // Clear all data in read_msg_
-                            do_read_header();
-                        }
-                    }
-                    else if (read_msg_.get_message_id() == "#C_A") {
-                        reciever_id_ = read_msg_.get_sender_id();
-                        do_read_body();
-                    }
-                    else if (read_msg_.get_message_id() == "#C_D") {
-                        std::cout << "chat request denied\n";
-                        reciever_id_ = 0;
-                        do_read_body();
-                    }
-                    else if (read_msg_.get_message_id() == "#S_C") {
-                        do_read_body();
-                    }
-                    else {
-                        std::cout << "unknown format " << read_msg_.get_message_id() << std::endl;
-                        read_msg_ = chat_message(); // Clear all data in read_msg_
-                        do_read_header();
-                    }
-                }
-                else {
+    // Reads whatever the socket has and handles every complete frame in it
+    // before reading again.
+    void do_read() {
+        boost::asio::mutable_buffer space = read_buffer_.prepare();
+        socket_.async_read_some(boost::asio::buffer(space),
+            [this](boost::system::error_code ec, std::size_t length) {
+                if (ec) {
                     std::cout << ec << std::endl;
+                    socket_.close();
+                    return;
+                }
+                read_buffer_.commit(length);
+
+                frame_buffer::result result;
+                while ((result = read_buffer_.next(read_msg_)) == frame_buffer::frame_ready) {
+                    handle_frame();
+                }
+                if (result == frame_buffer::bad_frame) {
                     std::cout << "closing socket " << "unknown format " << read_msg_.get_message_id() << std::endl;
                     socket_.close();
+                    return;
                 }
+                do_read();
             });
     }
 
-    void do_read_body() {
-        boost::asio::async_read(socket_,
-            boost::asio::buffer(read_msg_.body(), read_msg_.body_length()),
-            [this](boost::system::error_code ec, std::size_t /*length*/) {
-                if (!ec) {
-                    std::cout.write(read_msg_.body(), read_msg_.body_length());
-                    std::cout << "\n";
-                    read_msg_ = chat_message(); // Clear all data in read_msg_
-                    do_read_header();
+    void handle_frame() {
+        if (read_msg_.get_message_id() == "#REG") {
+            resume_sequence(read_msg_.get_sequence());
+            print_body();
+        }
+        else if (read_msg_.get_message_id() == "#S_C") {
+            print_body();
+        }
+        else if (read_msg_.get_message_id() == "#C_C") {
+            std::uint64_t reciever = read_msg_.get_sender_id();
+            char decesion;
+            bool f = true;
+            while (f == true) {
+
+                std::cout << "Do you want to chat with " << reciever << "? (y/n)";
+                std::cin >> decesion;
+                if (decesion == 'y') {
+                    message(*this, "#C_A", "Chat request accepted", reciever);
+                    std::cout << "Chat request accepted.\n";
+                    reciever_id_ = reciever;
+                    f = false;
+
+                }
+                else if (decesion == 'n') {
+                    message(*this, "#C_D", "Chat request denied", reciever);
+                    std::cout << "Chat request denied.\n";
+                    f = false;
                 }
                 else {
-                    socket_.close();
+                    std::cout << "Invalid input. Please enter 'y' or 'n'." << std::endl;
                 }
-            });
+            }
+        }
+        else if (read_msg_.get_message_id() == "#S_M") {
+            if (read_msg_.get_sender_id() == reciever_id_) {
+                print_body();
+            }
+            else {
+                std::cout << "Message from unknown sender\n";
+            }
+        }
+        else if (read_msg_.get_message_id() == "#C_A") {
+            reciever_id_ = read_msg_.get_sender_id();
+            print_body();
+        }
+        else if (read_msg_.get_message_id() == "#C_D") {
+            std::cout << "chat request denied\n";
+            reciever_id_ = 0;
+            print_body();
+        }
+        else if (read_msg_.get_message_id() == "#R_M") {
+            // Pushed messages and history replies both carry the peer in the
+            // receiver field and the newest message number in the sequence.
+            std::uint64_t& seen = last_seen_[read_msg_.get_receiver_id()];
+            seen = std::max(seen, read_msg_.get_sequence());
+            print_body();
+        }
+        else if (read_msg_.get_message_id() == "#U_C" || read_msg_.get_message_id() == "#R_R") {
+            print_body();
+        }
+        else if (read_msg_.get_message_id() == "#E_M") {
+            std::cout << "Server error: ";
+            print_body();
+        }
+        else if (read_msg_.get_message_id() == "#ACK") {
+            std::uint64_t acked = read_msg_.get_sequence();
+            while (!unacked_msgs_.empty() && unacked_msgs_.front().get_sequence() <= acked) {
+                unacked_msgs_.pop_front();
+            }
+            if (unacked_msgs_.empty()) {
+                retransmit_timer_.cancel();
+            }
+            else {
+                arm_retransmit();
+            }
+        }
+        else if (read_msg_.get_message_id() == "#NAK") {
+            resend_from(read_msg_.get_sequence());
+        }
+        else if (read_msg_.get_message_id() == "#LOG") {
+            resume_sequence(read_msg_.get_sequence());
+            print_body();
+        }
+        else {
+            std::cout << "unknown format " << read_msg_.get_message_id() << std::endl;
+        }
+    }
+
+    void print_body() {
+        std::cout.write(read_msg_.body(), read_msg_.body_length());
+        std::cout << "\n";
     }
 
     void do_write() {
@@ -244,16 +305,102 @@ private:
     }
 
 
+    void queue_write(const chat_message& msg) {
+        bool write_in_progress = !write_msgs_.empty();
+        write_msgs_.push_back(msg);
+        if (!write_in_progress) {
+            do_write();
+        }
+    }
+
+    void send_sequenced(chat_message msg) {
+        msg.encode_header("#S_M", msg.get_sender_id(), msg.get_receiver_id(), next_sequence_++);
+        if (unacked_msgs_.empty()) {
+            arm_retransmit();
+        }
+        unacked_msgs_.push_back(msg);
+        queue_write(msg);
+    }
+
+    // The server only answers #REG or #LOG when they succeed (failures come
+    // back as #E_M), and that reply carries the last sequence it stored for us.
+    // Unacked frames at or below it were stored and are dropped; the rest are
+    // sent again under their original numbers so the server can still tell
+    // them apart from new messages. Messages held back until now are numbered
+    // after everything else.
+    void resume_sequence(std::uint64_t last_stored) {
+        while (!unacked_msgs_.empty() && unacked_msgs_.front().get_sequence() <= last_stored) {
+            unacked_msgs_.pop_front();
+        }
+        for (const auto& msg : unacked_msgs_) {
+            queue_write(msg);
+        }
+        if (!unacked_msgs_.empty()) {
+            arm_retransmit();
+        }
+        next_sequence_ = std::max(next_sequence_, last_stored + 1);
+        sequence_known_ = true;
+
+        chat_message_queue held;
+        held.swap(held_msgs_);
+        for (const auto& msg : held) {
+            send_sequenced(msg);
+        }
+    }
+
+    // The server refused a frame that came after a gap; resend from the first
+    // missing one in order.
+    void resend_from(std::uint64_t expected) {
+        for (auto& msg : unacked_msgs_) {
+            if (msg.get_sequence() >= expected) {
+                queue_write(msg);
+            }
+        }
+    }
+
+    // Restarts the wait for the next ack. If none arrives in time every
+    // unacked frame is sent again; this covers frames the server dropped
+    // with nothing after them that would have made it send a #NAK.
+    void arm_retransmit() {
+        retransmit_timer_.expires_after(retransmit_interval);
+        retransmit_timer_.async_wait([this](boost::system::error_code ec) {
+            if (ec || !socket_.is_open() || unacked_msgs_.empty()) {
+                return;
+            }
+            resend_from(unacked_msgs_.front().get_sequence());
+            arm_retransmit();
+        });
+    }
+
+    // The server numbers #S_M frames per client instance rather than per
+    // user, so another login of the same user keeps its own sequence. The
+    // instance is picked once and kept for as long as unacked frames are.
+    static std::uint64_t generate_instance() {
+        std::random_device random;
+        return (static_cast<std::uint64_t>(random()) << 32) | random();
+    }
+
     void generate_unique_id() {
         auto now = std::chrono::system_clock::now();
         auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch());
         id_ = static_cast<std::uint64_t>(duration.count());
     }
 
+    static constexpr std::chrono::seconds retransmit_interval{ 2 };
+
     boost::asio::io_context& io_context_;
     tcp::socket socket_;
+    boost::asio::steady_timer retransmit_timer_;
+    socket_options options_;
+    frame_buffer read_buffer_;
     chat_message read_msg_;
     chat_message_queue write_msgs_;
+    chat_message_queue unacked_msgs_;
+    chat_message_queue held_msgs_;
+    std::unordered_map<std::uint64_t, std::uint64_t> last_seen_; // newest message number seen per peer
+    std::uint64_t next_sequence_;
+    bool sequence_known_;
+    std::uint64_t instance_;
     std::string name_;
     std::string password_;
     std::uint64_t id_;
@@ -289,7 +436,7 @@ int main(int argc, char* argv[]) {
         boost::asio::io_context io_context;
         tcp::resolver resolver(io_context);
         auto endpoints = resolver.resolve("localhost", "123");
-        chat_client c(io_context, endpoints);
+        chat_client c(io_context, endpoints, socket_options::load("client.conf"));
 
         std::thread t([&io_context]() { io_context.run(); });
 
@@ -302,6 +449,15 @@ int main(int argc, char* argv[]) {
             else if (line == "#S_C") {
                 message(c, "#S_C");
             }
+            else if (line == "#U_C") {
+                message(c, "#U_C");
+            }
+            else if (line == "#R_M") {
+                message(c, "#R_M", "", c.getreciever_id());
+            }
+            else if (line == "#R_R") {
+                c.mark_read();
+            }
             else if (line == "#C_C") {
                 std::uint64_t reciever;
                 std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
@@ -26,11 +26,12 @@ class chat_message
 
 {
 public:
-    enum { header_length = 48 }; // Updated header length to accommodate additional fields and changed data type of message_ids_
+    enum { header_length = 68 }; // body length, message id, sender, receiver and sequence number
     enum { max_body_length = 512 };
+    static constexpr std::size_t max_frame_length = static_cast<std::size_t>(header_length) + max_body_length;
 
     chat_message()
-        : body_length_(0), sender_id(0), receiver_id(0), message_id(""), data_("")
+        : body_length_(0), sender_id(0), receiver_id(0), sequence(0), message_id(""), data_("")
     {
     }
 
@@ -81,10 +82,11 @@ public:
         char m_id[5] = ""; // Ensure m_id is zero-terminated
         std::uint64_t s_id;
         std::uint64_t r_id;
+        std::uint64_t seq;
 
         std::cout << "decoding header" << std::endl;
         std::cout << "Recieved_header: " << header << std::endl;
-        if (std::sscanf(header, "%4d%4s%20llu%20llu", &body_len, m_id, &s_id, &r_id) != 4)
+        if (std::sscanf(header, "%4d%4s%20llu%20llu%20llu", &body_len, m_id, &s_id, &r_id, &seq) != 5)
         {
             body_length_ = 0;
             return false;
@@ -94,6 +96,7 @@ public:
         message_id = m_id;
         sender_id = s_id;
         receiver_id = r_id;
+        sequence = seq;
         std::cout << "sender_id: " << sender_id << std::endl;
         if (body_length_ > max_body_length)
         {
@@ -103,13 +106,15 @@ public:
         return true;
     }
 
-    void encode_header(std::string m_id = "#REG", std::uint64_t s_id = 0, std::uint64_t r_id = 0)
+    // A sequence number of 0 means the frame is not sequenced (and not acked).
+    void encode_header(std::string m_id = "#REG", std::uint64_t s_id = 0, std::uint64_t r_id = 0, std::uint64_t seq = 0)
     {
         message_id = m_id;
         sender_id = s_id;
         receiver_id = r_id;
+        sequence = seq;
         char header[header_length + 1] = "";
-        std::sprintf(header, "%4d%4s%20llu%20llu", static_cast<int>(body_length_), message_id.c_str(), sender_id, receiver_id); // the larges size these arguments can occupy is much larger so stack over flow may occure
+        std::sprintf(header, "%4d%4s%20llu%20llu%20llu", static_cast<int>(body_length_), message_id.c_str(), sender_id, receiver_id, sequence); // the larges size these arguments can occupy is much larger so stack over flow may occure
         std::cout << "Encoded header: " << header << "'\n";
         std::memcpy(data_, header, header_length);
     }
@@ -125,11 +130,16 @@ public:
     std::uint64_t get_receiver_id() {
         return receiver_id;
     }
+
+    std::uint64_t get_sequence() {
+        return sequence;
+    }
 private:
     std::uint64_t sender_id;
     std::uint64_t receiver_id;
+    std::uint64_t sequence;
     std::string message_id;
-    char data_[header_length + max_body_length];
+    char data_[max_frame_length];
     std::size_t body_length_;
 };
 
@@ -1,10 +1,15 @@
 #include <iostream>
+#include <utility>
 #include <boost/asio.hpp>
 #include <unordered_map>
 #include <string>
 #include <sstream>
 #include <vector>
+#include <algorithm>
 #include "chat_message.hpp"
+#include "frame_buffer.hpp"
+#include "rate_limiter.hpp"
+#include "server_config.hpp"
 #include "database.hpp" // Include the database header
 
 using boost::asio::ip::tcp;
@@ -14,27 +19,28 @@ std::unordered_map<std::uint64_t, std::shared_ptr<class chat_session>> sessions_
 
 class chat_session : public std::enable_shared_from_this<chat_session> {
 public:
-    explicit chat_session(tcp::socket socket, Database& db)
-        : socket_(std::move(socket)), client_id_(0), database_(db) {
+    chat_session(tcp::socket socket, Database& db, rate_limiter& limiter, const server_config& config)
+        : socket_(std::move(socket)), timer_(socket_.get_executor()),
+          read_buffer_(config.socket.read_buffer_size), frames_in_turn_(0), rate_limited_(false),
+          acked_sequence_(0), sent_ack_(0), nak_sequence_(0), client_id_(0), client_instance_(0),
+          database_(db), limiter_(limiter), config_(config) {
+        timer_.expires_at(std::chrono::steady_clock::time_point::max());
     }
 
+    // The session is kept alive by the two coroutines, each of which holds a
+    // single reference for its whole lifetime rather than one per operation.
     void start() {
-        do_read_header();
+        config_.socket.apply(socket_);
+        auto self(shared_from_this());
+        boost::asio::co_spawn(socket_.get_executor(),
+            [self] { return self->reader(); }, boost::asio::detached);
+        boost::asio::co_spawn(socket_.get_executor(),
+            [self] { return self->writer(); }, boost::asio::detached);
     }
 
-    void send_message(const std::string& message, const std::string& msg_id_ = "", std::uint64_t receiver_id = 0) {
-        chat_message msg;
-        msg.body_length(message.size());
-        std::memcpy(msg.body(), message.c_str(), msg.body_length());
-        msg.encode_header(msg_id_, client_id_, receiver_id);
-
-        auto self(shared_from_this());
-        boost::asio::async_write(socket_, boost::asio::buffer(msg.data(), msg.length()),
-            [this, self](boost::system::error_code ec, std::size_t) {
-                if (ec) {
-                    handle_disconnect();
-                }
-            });
+    void send_message(const std::string& message, const std::string& msg_id_ = "", std::uint64_t receiver_id = 0, std::uint64_t sequence = 0) {
+        write_msgs_.push_back(make_message(message, msg_id_, receiver_id, sequence));
+        timer_.cancel_one(); // wake the writer
     }
 
     std::uint64_t get_client_id() const {
@@ -42,77 +48,156 @@ public:
     }
 
 private:
-    void do_read_header() {
-        auto self(shared_from_this());
-        boost::asio::async_read(socket_,
-            boost::asio::buffer(read_msg_.data(), chat_message::header_length),
-            [this, self](boost::system::error_code ec, std::size_t) {
-                if (!ec && read_msg_.decode_header()) {
-                    do_read_body();
+    // Reads whatever the socket has into read_buffer_ and handles every
+    // complete frame in it before reading again.
+    boost::asio::awaitable<void> reader() {
+        try {
+            for (;;) {
+                std::size_t length = co_await socket_.async_read_some(read_buffer_.prepare(), boost::asio::use_awaitable);
+                read_buffer_.commit(length);
+
+                frame_buffer::result result;
+                while ((result = read_buffer_.next(read_msg_)) == frame_buffer::frame_ready) {
+                    if (limiter_.allow(current_limits(), read_msg_.get_message_id())) {
+                        rate_limited_ = false;
+                        handle_message();
+                    }
+                    else {
+                        // A dropped #S_M may be the one a #NAK already asked
+                        // for, so the next gap is reported again.
+                        if (read_msg_.get_message_id() == "#S_M") {
+                            nak_sequence_ = 0;
+                        }
+                        // One notice per run of rejected frames, so a client
+                        // that floods without reading cannot grow write_msgs_.
+                        if (!rate_limited_) {
+                            rate_limited_ = true;
+                            send_message("Rate limit exceeded.", "#E_M");
+                        }
+                    }
+
+                    // Let other sessions run before a busy client gets any further.
+                    if (++frames_in_turn_ >= config_.max_frames_per_turn) {
+                        frames_in_turn_ = 0;
+                        co_await boost::asio::post(socket_.get_executor(), boost::asio::use_awaitable);
+                    }
                 }
-                else {
-                    handle_disconnect();
+                if (result == frame_buffer::bad_frame) {
+                    break;
                 }
-            });
+                frames_in_turn_ = 0;
+            }
+        }
+        catch (std::exception&) {
+        }
+        handle_disconnect();
     }
 
-    void do_read_body() {
-        auto self(shared_from_this());
-        boost::asio::async_read(socket_,
-            boost::asio::buffer(read_msg_.body(), read_msg_.body_length()),
-            [this, self](boost::system::error_code ec, std::size_t) {
-                if (!ec) {
-                    handle_message();
-                    do_read_header();
+    // Everything queued while a write was in flight goes out in the next
+    // single gathered write. write_msgs_ and writing_ are swapped rather than
+    // copied and keep their capacity, so once they have grown to the busiest
+    // batch a session sees, queueing a frame does not allocate.
+    //
+    // Sequenced #S_M frames are acknowledged cumulatively: each batch starts
+    // with one #ACK carrying the highest sequence stored so far, so every #S_M
+    // that arrived while a write was in flight shares one ack.
+    boost::asio::awaitable<void> writer() {
+        try {
+            while (socket_.is_open()) {
+                if (write_msgs_.empty() && acked_sequence_ == sent_ack_) {
+                    boost::system::error_code ec;
+                    co_await timer_.async_wait(
+                        boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+                    continue;
                 }
-                else {
-                    handle_disconnect();
+
+                write_buffers_.clear();
+                if (acked_sequence_ != sent_ack_) {
+                    sent_ack_ = acked_sequence_;
+                    ack_msg_ = make_message("", "#ACK", 0, sent_ack_);
+                    write_buffers_.push_back(boost::asio::buffer(ack_msg_.data(), ack_msg_.length()));
                 }
-            });
+                writing_.swap(write_msgs_);
+                for (const auto& msg : writing_) {
+                    write_buffers_.push_back(boost::asio::buffer(msg.data(), msg.length()));
+                }
+
+                co_await boost::asio::async_write(socket_, write_buffers_, boost::asio::use_awaitable);
+                writing_.clear();
+            }
+        }
+        catch (std::exception&) {
+            handle_disconnect();
+        }
+    }
+
+    // Logged in users are limited across all of their connections, anonymous
+    // sessions (still registering or logging in) only per connection.
+    rate_limiter::user_limits& current_limits() {
+        if (client_id_ == 0) return anonymous_limits_;
+        return limiter_.limits_for(client_id_);
     }
 
     void handle_message() {
         std::string msg_str(read_msg_.body(), read_msg_.body_length());
 
+        // #REG and #LOG bodies may end in ":instance", the client instance
+        // that numbers this connection's #S_M frames (see Database::add_message).
+        // Only a successful registration or login is answered with #REG or
+        // #LOG; failures are #E_M so the client never resumes sending on a
+        // connection that is not logged in.
         if (read_msg_.get_message_id() == "#REG") {
             auto parts = split_string(msg_str, ':');
-            if (parts.size() == 2) {
+            if (parts.size() == 2 || parts.size() == 3) {
                 std::string name = parts[0];
                 std::string password = parts[1];
-                client_id_ = read_msg_.get_sender_id();
+                std::uint64_t id = read_msg_.get_sender_id();
+                std::uint64_t instance = parts.size() == 3 ? std::stoull(parts[2]) : 0;
 
-                if (database_.add_user(client_id_, name, password)) {
-                    send_message("Welcome " + name, "#REG");
+                // The session only takes on the id once it owns it, so a
+                // failed #REG cannot spend another user's rate limits.
+                if (database_.add_user(id, name, password)) {
+                    client_id_ = id;
+                    client_instance_ = instance;
+                    acked_sequence_ = sent_ack_ = database_.get_last_sequence(client_id_, client_instance_);
+                    nak_sequence_ = 0;
+                    send_message("Welcome " + name, "#REG", 0, acked_sequence_);
                     sessions_[client_id_] = shared_from_this();
                 }
                 else {
-                    send_message("User already exists.", "#REG");
+                    send_message("User already exists.", "#E_M");
                 }
             }
             else {
-                send_message("Invalid registration format.", "#REG");
+                send_message("Invalid registration format.", "#E_M");
             }
         }
         else if (read_msg_.get_message_id() == "#LOG") {
             auto parts = split_string(msg_str, ':');
-            if (parts.size() == 2) {
+            if (parts.size() == 2 || parts.size() == 3) {
                 std::uint64_t id = std::stoull(parts[0]);
                 std::string password = parts[1];
+                std::uint64_t instance = parts.size() == 3 ? std::stoull(parts[2]) : 0;
                 auto user = database_.get_user(id);
                 if (!user.has_value()) {
-                    send_message("No user of that ID.", "#LOG");
+                    send_message("No user of that ID.", "#E_M");
                 }
                 else if (user->second != password) {
-                    send_message("Wrong password.", "#LOG");
+                    send_message("Wrong password.", "#E_M");
                 }
                 else {
+                    // Tell the client where its sequence numbers left off so
+                    // that it only resends what was never stored.
                     client_id_ = id;
-                    send_message("Welcome back, " + user->first, "#LOG");
+                    client_instance_ = instance;
+                    acked_sequence_ = sent_ack_ = database_.get_last_sequence(client_id_, client_instance_);
+                    nak_sequence_ = 0;
+                    send_message("Welcome back, " + user->first, "#LOG", 0, acked_sequence_);
                     sessions_[client_id_] = shared_from_this();
                 }
             }
             else {
-                send_message("Invalid login format.", "#LOG");
+                send_message("Invalid login format.", "#E_M");
             }
         }
         else if (read_msg_.get_message_id() == "#S_C") {
@@ -137,35 +222,88 @@ private:
         }
         else if (read_msg_.get_message_id() == "#S_M") {
             std::uint64_t receiver_id = read_msg_.get_receiver_id();
-            if (database_.add_message(client_id_, receiver_id, msg_str)) {
-                send_message("Message saved.", "#S_M");
+            std::uint64_t sequence = read_msg_.get_sequence();
+            auto result = database_.add_message(client_id_, receiver_id, msg_str, sequence, client_instance_);
+            if (result == Database::stored) {
+                if (sequence == 0) {
+                    send_message("Message saved.", "#S_M");
+                }
                 if (sessions_.find(receiver_id) != sessions_.end()) {
-                    sessions_[receiver_id]->send_message(msg_str, "#R_M", client_id_);
+                    // The sequence field carries the message's number in the
+                    // conversation, which the client echoes back in #R_R.
+                    std::uint64_t number = database_.get_read_state(receiver_id, client_id_).received;
+                    sessions_[receiver_id]->send_message(msg_str, "#R_M", client_id_, number);
                 }
             }
-            else {
-                send_message("Failed to save message.", "#S_M");
+
+            if (result == Database::out_of_order) {
+                // An earlier frame was dropped (e.g. rate limited). Ask for
+                // everything from the first missing sequence onwards, once
+                // until another frame is dropped.
+                std::uint64_t expected = database_.get_last_sequence(client_id_, client_instance_) + 1;
+                if (nak_sequence_ != expected) {
+                    nak_sequence_ = expected;
+                    send_message("", "#NAK", 0, expected);
+                }
+            }
+            else if (sequence != 0) {
+                // Ack only what is stored, which is always a contiguous prefix;
+                // a duplicate was stored before and is covered by it.
+                acked_sequence_ = database_.get_last_sequence(client_id_, client_instance_);
+                timer_.cancel_one();
             }
         }
         else if (read_msg_.get_message_id() == "#R_M") {
-            auto messages = database_.get_messages(client_id_, read_msg_.get_receiver_id());
+            std::uint64_t peer_id = read_msg_.get_receiver_id();
+            auto messages = database_.get_messages(client_id_, peer_id);
             std::ostringstream oss;
             for (const auto& message : messages) {
                 oss << "From: " << message.sender_id << ", To: " << message.receiver_id << " - " << message.content << "\n";
             }
-            send_message(oss.str(), "#R_M");
+            send_message(oss.str(), "#R_M", peer_id, database_.get_read_state(client_id_, peer_id).received);
+        }
+        else if (read_msg_.get_message_id() == "#R_R") {
+            // Read receipt: the client has read messages from receiver_id up
+            // to the number in the sequence field.
+            std::uint64_t sender_id = read_msg_.get_receiver_id();
+            std::uint64_t up_to = read_msg_.get_sequence();
+            database_.mark_read(client_id_, sender_id, up_to);
+            if (sessions_.find(sender_id) != sessions_.end()) {
+                sessions_[sender_id]->send_message("Messages read.", "#R_R", client_id_, up_to);
+            }
+        }
+        else if (read_msg_.get_message_id() == "#U_C") {
+            auto counts = database_.get_unread_counts(client_id_);
+            std::ostringstream oss;
+            for (const auto& count : counts) {
+                oss << "ID: " << count.first << ", Unread: " << count.second.received - count.second.read
+                    << ", Last: " << count.second.received << "\n";
+            }
+            send_message(oss.str(), "#U_C");
         }
         else {
             send_message("Unknown command: " + msg_str);
         }
     }
 
+    chat_message make_message(const std::string& message, const std::string& msg_id_, std::uint64_t receiver_id, std::uint64_t sequence) {
+        chat_message msg;
+        msg.body_length(message.size());
+        std::memcpy(msg.body(), message.c_str(), msg.body_length());
+        msg.encode_header(msg_id_, client_id_, receiver_id, sequence);
+        return msg;
+    }
+
     void handle_disconnect() {
+        if (!socket_.is_open()) return; // reader and writer can both get here
         std::cerr << "Client disconnected.\n";
-        if (client_id_ != 0) {
-            sessions_.erase(client_id_);
+        auto it = sessions_.find(client_id_);
+        if (it != sessions_.end() && it->second.get() == this) {
+            sessions_.erase(it);
         }
-        socket_.close();
+        boost::system::error_code ec;
+        socket_.close(ec);
+        timer_.cancel();
     }
 
     std::vector<std::string> split_string(const std::string& str, char delimiter) {
@@ -179,15 +317,31 @@ private:
     }
 
     tcp::socket socket_;
+    boost::asio::steady_timer timer_;
+    frame_buffer read_buffer_;
     chat_message read_msg_;
+    std::vector<chat_message> write_msgs_; // queued by send_message
+    std::vector<chat_message> writing_;    // the batch writer() is sending
+    std::vector<boost::asio::const_buffer> write_buffers_;
+    chat_message ack_msg_;
+    rate_limiter::user_limits anonymous_limits_;
+    std::size_t frames_in_turn_;
+    bool rate_limited_;
+    std::uint64_t acked_sequence_;
+    std::uint64_t sent_ack_;
+    std::uint64_t nak_sequence_;
     std::uint64_t client_id_;
+    std::uint64_t client_instance_;
     Database& database_;
+    rate_limiter& limiter_;
+    const server_config& config_;
 };
 
 class chat_server {
 public:
-    chat_server(boost::asio::io_context& io_context, short port, Database& db)
-        : acceptor_(io_context, tcp::endpoint(tcp::v4(), port)), database_(db) {
+    chat_server(boost::asio::io_context& io_context, short port, Database& db, const server_config& config)
+        : acceptor_(io_context, tcp::endpoint(tcp::v4(), port)), database_(db),
+          limiter_(config.user_limit, config.command_limits), config_(config) {
         do_accept();
     }
 
@@ -196,7 +350,7 @@ private:
         acceptor_.async_accept(
             [this](boost::system::error_code ec, tcp::socket socket) {
                 if (!ec) {
-                    std::make_shared<chat_session>(std::move(socket), database_)->start();
+                    std::make_shared<chat_session>(std::move(socket), database_, limiter_, config_)->start();
                 }
                 do_accept();
             });
@@ -204,6 +358,50 @@ private:
 
     tcp::acceptor acceptor_;
     Database& database_;
+    rate_limiter limiter_;
+    const server_config& config_;
+};
+
+// Runs Database::compact on its own thread, once at startup and then every
+// compaction_interval seconds, so the reactor keeps serving sessions while the
+// files are rewritten. It runs even with retention off, since the sequence
+// and read state logs still need rewriting.
+class compaction_task {
+public:
+    compaction_task(boost::asio::io_context& io_context, Database& db, const server_config& config)
+        : timer_(io_context), database_(db), config_(config), background_(1) {
+        schedule(std::chrono::seconds(0));
+    }
+
+private:
+    void schedule(std::chrono::seconds delay) {
+        timer_.expires_after(delay);
+        timer_.async_wait([this](boost::system::error_code ec) {
+            if (!ec) {
+                boost::asio::post(background_, [this] { run(); });
+            }
+        });
+    }
+
+    void run() {
+        try {
+            std::size_t removed = database_.compact(config_.retention);
+            if (removed != 0) {
+                std::cout << "Compaction removed " << removed << " messages.\n";
+            }
+        }
+        catch (std::exception& e) {
+            std::cerr << "Compaction failed: " << e.what() << "\n";
+        }
+        boost::asio::post(timer_.get_executor(), [this] {
+            schedule(std::chrono::seconds(config_.compaction_interval));
+        });
+    }
+
+    boost::asio::steady_timer timer_;
+    Database& database_;
+    const server_config& config_;
+    boost::asio::thread_pool background_;
 };
 
 int main(int argc, char* argv[]) {
@@ -211,8 +409,10 @@ int main(int argc, char* argv[]) {
         short port = (argc == 2) ? std::atoi(argv[1]) : 123;
         boost::asio::io_context io_context;
 
+        server_config config = server_config::load("server.conf");
         Database db("users.txt", "messages.txt"); // Create database instance
-        chat_server server(io_context, port, db);
+        chat_server server(io_context, port, db, config);
+        compaction_task compaction(io_context, db, config);
 
         io_context.run();
     }
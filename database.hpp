@@ -1,25 +1,60 @@
 #ifndef DATABASE_HPP
 #define DATABASE_HPP
 
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <filesystem>
 #include <fstream>
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <vector>
 #include <mutex>
 #include <optional>
+#include <sstream>
+#include <stdexcept>
 
 struct Message {
     std::uint64_t sender_id;
     std::uint64_t receiver_id;
     std::string content;
+    std::uint64_t timestamp; // seconds since the epoch
+};
+
+// Per (receiver, sender) count of messages received and how many of them the
+// receiver has read. Messages in a conversation are numbered 1, 2, ... in the
+// order they arrive, so "read" is a watermark: unread = received - read.
+struct read_state {
+    std::uint64_t received = 0;
+    std::uint64_t read = 0;
+};
+
+// Limits enforced by Database::compact; 0 means no limit.
+struct retention_policy {
+    std::uint64_t max_age_seconds = 0;
+    std::size_t max_messages_per_conversation = 0;
+    std::size_t max_total_bytes = 0; // approximate size of the message file
+
+    bool enabled() const {
+        return max_age_seconds != 0 || max_messages_per_conversation != 0 || max_total_bytes != 0;
+    }
 };
 
 class Database {
 public:
+    enum add_result { stored, duplicate, out_of_order };
+
     Database(const std::string& user_file, const std::string& message_file)
-        : user_file_(user_file), message_file_(message_file) {
+        : user_file_(user_file), message_file_(message_file), sequence_file_(message_file + ".seq"),
+          read_state_file_(message_file + ".read") {
         load_users();
         load_messages();
+        load_sequences();
+        load_read_states();
+        message_out_.open(message_file_, std::ios::app);
+        sequence_out_.open(sequence_file_, std::ios::app);
+        read_state_out_.open(read_state_file_, std::ios::app);
     }
 
     bool add_user(std::uint64_t id, const std::string& name, const std::string& password) {
@@ -45,26 +80,270 @@ public:
         return users_;
     }
 
-    bool add_message(std::uint64_t sender_id, std::uint64_t receiver_id, const std::string& content) {
+    // Messages carrying a sequence number are stored exactly once and in order
+    // per client instance, the id a client picks once and sends when it logs
+    // in so that two connections of the same user are numbered separately.
+    // Only the instance's last sequence + 1 is stored, anything at or below
+    // the last one is a retry, and anything above it leaves a gap and is
+    // refused so the stored sequences always form a contiguous prefix.
+    add_result add_message(std::uint64_t sender_id, std::uint64_t receiver_id, const std::string& content,
+                           std::uint64_t sequence = 0, std::uint64_t instance = 0) {
         std::lock_guard<std::mutex> lock(mutex_);
-        messages_.emplace_back(Message{ sender_id, receiver_id, content });
-        save_messages();
-        return true;
+        if (sequence != 0) {
+            auto& last = last_sequence_[sender_id][instance];
+            if (sequence <= last) return duplicate;
+            if (sequence != last + 1) return out_of_order;
+            last = sequence;
+            append_sequence(sender_id, instance);
+        }
+        recent_.push_back(Message{ sender_id, receiver_id, content, now_seconds() });
+        write_message(message_out_, recent_.back());
+        message_out_.flush();
+        ++read_states_[receiver_id][sender_id].received;
+        append_read_state(receiver_id, sender_id);
+        return stored;
+    }
+
+    std::uint64_t get_last_sequence(std::uint64_t sender_id, std::uint64_t instance = 0) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = last_sequence_.find(sender_id);
+        if (it == last_sequence_.end()) return 0;
+        auto last = it->second.find(instance);
+        return last != it->second.end() ? last->second : 0;
+    }
+
+    // Marks messages from sender_id up to number up_to as read by receiver_id.
+    // The watermark only moves forward and never past what has arrived, so a
+    // message that comes in after the client last looked stays unread.
+    void mark_read(std::uint64_t receiver_id, std::uint64_t sender_id, std::uint64_t up_to) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = read_states_.find(receiver_id);
+        if (it == read_states_.end()) return;
+        auto state = it->second.find(sender_id);
+        if (state == it->second.end()) return;
+
+        std::uint64_t read = std::min(up_to, state->second.received);
+        if (read <= state->second.read) return;
+        state->second.read = read;
+        append_read_state(receiver_id, sender_id);
+    }
+
+    read_state get_read_state(std::uint64_t receiver_id, std::uint64_t sender_id) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = read_states_.find(receiver_id);
+        if (it == read_states_.end()) return {};
+        auto state = it->second.find(sender_id);
+        return state != it->second.end() ? state->second : read_state{};
+    }
+
+    // Read state for receiver_id keyed by sender, for conversations with unread messages only.
+    std::unordered_map<std::uint64_t, read_state> get_unread_counts(std::uint64_t receiver_id) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::unordered_map<std::uint64_t, read_state> result;
+        auto it = read_states_.find(receiver_id);
+        if (it != read_states_.end()) {
+            for (const auto& state : it->second) {
+                if (state.second.received != state.second.read) {
+                    result.insert(state);
+                }
+            }
+        }
+        return result;
     }
 
     std::vector<Message> get_messages(std::uint64_t sender_id, std::uint64_t receiver_id) const {
         std::lock_guard<std::mutex> lock(mutex_);
         std::vector<Message> result;
-        for (const auto& msg : messages_) {
-            if ((msg.sender_id == sender_id && msg.receiver_id == receiver_id) ||
-                (msg.sender_id == receiver_id && msg.receiver_id == sender_id)) {
-                result.push_back(msg);
+        for (const auto* messages : { compacted_.get(), &recent_ }) {
+            for (const auto& msg : *messages) {
+                if ((msg.sender_id == sender_id && msg.receiver_id == receiver_id) ||
+                    (msg.sender_id == receiver_id && msg.receiver_id == sender_id)) {
+                    result.push_back(msg);
+                }
             }
         }
         return result;
     }
 
+    // Drops the messages the policy no longer allows, keeping the newest ones,
+    // and rewrites the message file. The sequence and read state logs grow by
+    // a line per message whether or not anything is dropped, so they are
+    // rewritten to one line per key every time. Returns the number of
+    // messages removed.
+    std::size_t compact(const retention_policy& policy) {
+        std::lock_guard<std::mutex> compaction_lock(compaction_mutex_);
+        std::size_t removed = policy.enabled() ? remove_messages(policy) : 0;
+        rewrite_state_files();
+        return removed;
+    }
+
 private:
+    // Messages are picked and written without the mutex; it is only taken to
+    // snapshot the messages added since the last compaction and to swap in the
+    // result, so other calls are not held up for long.
+    std::size_t remove_messages(const retention_policy& policy) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        std::shared_ptr<const std::vector<Message>> compacted = compacted_;
+        std::vector<Message> recent = recent_;
+        lock.unlock();
+
+        std::size_t total = compacted->size() + recent.size();
+        auto at = [&](std::size_t i) -> const Message& {
+            return i < compacted->size() ? (*compacted)[i] : recent[i - compacted->size()];
+        };
+
+        // Walk from newest to oldest so the limits keep the most recent messages.
+        std::vector<bool> keep(total, true);
+        std::uint64_t now = now_seconds();
+        std::uint64_t oldest = policy.max_age_seconds != 0 && policy.max_age_seconds < now ? now - policy.max_age_seconds : 0;
+        std::unordered_map<std::uint64_t, std::unordered_map<std::uint64_t, std::size_t>> per_conversation;
+        std::size_t bytes = 0;
+        for (std::size_t i = total; i-- > 0;) {
+            const Message& msg = at(i);
+            if (msg.timestamp < oldest) {
+                keep[i] = false;
+                continue;
+            }
+            if (policy.max_messages_per_conversation != 0) {
+                auto& count = per_conversation[std::min(msg.sender_id, msg.receiver_id)][std::max(msg.sender_id, msg.receiver_id)];
+                if (count >= policy.max_messages_per_conversation) {
+                    keep[i] = false;
+                    continue;
+                }
+                ++count;
+            }
+            if (policy.max_total_bytes != 0) {
+                bytes += stored_size(msg);
+                if (bytes > policy.max_total_bytes) {
+                    keep[i] = false;
+                    continue;
+                }
+            }
+        }
+
+        auto survivors = std::make_shared<std::vector<Message>>();
+        survivors->reserve(std::count(keep.begin(), keep.end(), true));
+        for (std::size_t i = 0; i < total; ++i) {
+            if (keep[i]) survivors->push_back(at(i));
+        }
+        std::size_t removed = total - survivors->size();
+
+        // Conversations that lost messages, with how many of theirs are left.
+        std::unordered_map<std::uint64_t, std::unordered_map<std::uint64_t, std::uint64_t>> remaining; // receiver -> sender
+        for (std::size_t i = 0; i < total; ++i) {
+            if (!keep[i]) remaining[at(i).receiver_id][at(i).sender_id] = 0;
+        }
+        for (const auto& msg : *survivors) {
+            auto receiver = remaining.find(msg.receiver_id);
+            if (receiver == remaining.end()) continue;
+            auto sender = receiver->second.find(msg.sender_id);
+            if (sender != receiver->second.end()) ++sender->second;
+        }
+
+        std::string compact_file = message_file_ + ".compact";
+        std::ofstream file;
+        if (removed != 0) {
+            file.open(compact_file, std::ios::trunc);
+            for (const auto& msg : *survivors) {
+                write_message(file, msg);
+            }
+        }
+
+        lock.lock();
+        // Anything added while we worked is already in the old file; it stays
+        // in recent_ and is carried over to the new file. Nothing in memory
+        // changes until the new file has replaced the old one.
+        if (removed != 0) {
+            for (auto it = recent_.begin() + recent.size(); it != recent_.end(); ++it) {
+                write_message(file, *it);
+            }
+            finish_file(file, compact_file);
+            swap_in(compact_file, message_file_, message_out_);
+        }
+        recent_.erase(recent_.begin(), recent_.begin() + recent.size());
+        compacted_ = std::move(survivors);
+
+        // Unread messages that were dropped can no longer be read; move the
+        // watermark up so the unread count never exceeds what is stored.
+        // Only conversations that lost messages are visited.
+        for (const auto& msg : recent_) {
+            auto receiver = remaining.find(msg.receiver_id);
+            if (receiver == remaining.end()) continue;
+            auto sender = receiver->second.find(msg.sender_id);
+            if (sender != receiver->second.end()) ++sender->second;
+        }
+        for (const auto& receiver : remaining) {
+            auto states = read_states_.find(receiver.first);
+            if (states == read_states_.end()) continue;
+            for (const auto& sender : receiver.second) {
+                auto state = states->second.find(sender.first);
+                if (state == states->second.end()) continue;
+                if (state->second.received - state->second.read > sender.second) {
+                    state->second.read = state->second.received - sender.second;
+                    append_read_state(receiver.first, sender.first);
+                }
+            }
+        }
+        return removed;
+    }
+
+    // Rewrites the sequence and read state logs with one line per key, the
+    // same way remove_messages rewrites the message file: the maps are copied
+    // under the mutex and written without it. Keys that change in between
+    // are noted by append_sequence and append_read_state, and their current
+    // values are added under the mutex just before the new files are swapped
+    // in; the last line for a key wins when the files are loaded.
+    void rewrite_state_files() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto sequences = last_sequence_;
+        auto read_states = read_states_;
+        rewriting_ = true;
+        lock.unlock();
+
+        std::string sequence_compact = sequence_file_ + ".compact";
+        std::ofstream sequence_file(sequence_compact, std::ios::trunc);
+        for (const auto& sender : sequences) {
+            for (const auto& last : sender.second) {
+                write_sequence(sequence_file, sender.first, last.first, last.second);
+            }
+        }
+        std::string read_state_compact = read_state_file_ + ".compact";
+        std::ofstream read_state_file(read_state_compact, std::ios::trunc);
+        for (const auto& receiver : read_states) {
+            for (const auto& sender : receiver.second) {
+                write_read_state(read_state_file, receiver.first, sender.first, sender.second);
+            }
+        }
+
+        lock.lock();
+        rewriting_ = false;
+        for (const auto& key : changed_sequences_) {
+            write_sequence(sequence_file, key.first, key.second, last_sequence_[key.first][key.second]);
+        }
+        for (const auto& key : changed_read_states_) {
+            write_read_state(read_state_file, key.first, key.second, read_states_[key.first][key.second]);
+        }
+        changed_sequences_.clear();
+        changed_read_states_.clear();
+        finish_file(sequence_file, sequence_compact);
+        swap_in(sequence_compact, sequence_file_, sequence_out_);
+        finish_file(read_state_file, read_state_compact);
+        swap_in(read_state_compact, read_state_file_, read_state_out_);
+    }
+
+    // Appends the current value for a key to its log. Called with the mutex held.
+    void append_sequence(std::uint64_t sender_id, std::uint64_t instance) {
+        write_sequence(sequence_out_, sender_id, instance, last_sequence_[sender_id][instance]);
+        sequence_out_.flush();
+        if (rewriting_) changed_sequences_.emplace_back(sender_id, instance);
+    }
+
+    void append_read_state(std::uint64_t receiver_id, std::uint64_t sender_id) {
+        write_read_state(read_state_out_, receiver_id, sender_id, read_states_[receiver_id][sender_id]);
+        read_state_out_.flush();
+        if (rewriting_) changed_read_states_.emplace_back(receiver_id, sender_id);
+    }
+
     void load_users() {
         std::ifstream file(user_file_);
         if (!file.is_open()) return;
@@ -83,32 +362,134 @@ private:
         }
     }
 
+    // Lines are "sender receiver @timestamp content". Lines from before
+    // timestamps were stored have no "@timestamp" and count as new.
     void load_messages() {
+        auto messages = std::make_shared<std::vector<Message>>();
+        compacted_ = messages;
+
         std::ifstream file(message_file_);
         if (!file.is_open()) return;
 
         std::uint64_t sender_id, receiver_id;
+        std::uint64_t now = now_seconds();
         std::string content;
         while (file >> sender_id >> receiver_id && std::getline(file, content)) {
             if (!content.empty() && content.front() == ' ') {
                 content.erase(0, 1); // Remove leading space
             }
-            messages_.push_back({ sender_id, receiver_id, content });
+            std::uint64_t timestamp = now;
+            if (!content.empty() && content.front() == '@') {
+                std::size_t end = std::min(content.find(' '), content.size());
+                std::uint64_t value;
+                auto parsed = std::from_chars(content.data() + 1, content.data() + end, value);
+                if (parsed.ec == std::errc() && parsed.ptr == content.data() + end) {
+                    timestamp = value;
+                    content.erase(0, std::min(end + 1, content.size()));
+                }
+            }
+            messages->push_back({ sender_id, receiver_id, content, timestamp });
         }
     }
 
-    void save_messages() {
-        std::ofstream file(message_file_);
-        for (const auto& msg : messages_) {
-            file << msg.sender_id << " " << msg.receiver_id << " " << msg.content << "\n";
+    // The sequence file is appended one "sender instance sequence" line per
+    // stored sequenced message; the last line for an instance wins. Lines
+    // written before instances were tracked have no instance and count as 0.
+    void load_sequences() {
+        std::ifstream file(sequence_file_);
+        if (!file.is_open()) return;
+
+        std::string line;
+        while (std::getline(file, line)) {
+            std::istringstream fields(line);
+            std::uint64_t sender_id, instance, sequence;
+            if (!(fields >> sender_id >> instance)) continue;
+            if (!(fields >> sequence)) {
+                sequence = instance;
+                instance = 0;
+            }
+            last_sequence_[sender_id][instance] = sequence;
         }
     }
 
+    // Read states are appended as "receiver sender received read" lines
+    // whenever they change; the last line for a pair wins.
+    void load_read_states() {
+        std::ifstream file(read_state_file_);
+        if (!file.is_open()) return;
+
+        std::uint64_t receiver_id, sender_id;
+        read_state state;
+        while (file >> receiver_id >> sender_id >> state.received >> state.read) {
+            read_states_[receiver_id][sender_id] = state;
+        }
+    }
+
+    // Closes a freshly written replacement file, throwing (and removing it)
+    // unless every write made it out, so a full disk cannot truncate a store.
+    static void finish_file(std::ofstream& file, const std::string& path) {
+        file.flush();
+        bool written = file.good();
+        file.close();
+        if (!written || file.fail()) {
+            std::error_code ec;
+            std::filesystem::remove(path, ec);
+            throw std::runtime_error("could not write " + path);
+        }
+    }
+
+    // Renames replacement over path while out, the append stream on path, is
+    // closed. out is reopened whether or not the rename succeeds.
+    static void swap_in(const std::string& replacement, const std::string& path, std::ofstream& out) {
+        out.close();
+        try {
+            std::filesystem::rename(replacement, path);
+        }
+        catch (...) {
+            out.open(path, std::ios::app);
+            throw;
+        }
+        out.open(path, std::ios::app);
+    }
+
+    static void write_sequence(std::ostream& file, std::uint64_t sender_id, std::uint64_t instance, std::uint64_t sequence) {
+        file << sender_id << " " << instance << " " << sequence << "\n";
+    }
+
+    static void write_read_state(std::ostream& file, std::uint64_t receiver_id, std::uint64_t sender_id, const read_state& state) {
+        file << receiver_id << " " << sender_id << " " << state.received << " " << state.read << "\n";
+    }
+
+    static void write_message(std::ostream& file, const Message& msg) {
+        file << msg.sender_id << " " << msg.receiver_id << " @" << msg.timestamp << " " << msg.content << "\n";
+    }
+
+    static std::size_t stored_size(const Message& msg) {
+        return msg.content.size() + 64; // ids, timestamp and separators
+    }
+
+    static std::uint64_t now_seconds() {
+        auto now = std::chrono::system_clock::now().time_since_epoch();
+        return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::seconds>(now).count());
+    }
+
     std::unordered_map<std::uint64_t, std::pair<std::string, std::string>> users_;
-    std::vector<Message> messages_;
+    std::shared_ptr<const std::vector<Message>> compacted_; // immutable, replaced by compact()
+    std::vector<Message> recent_;                           // added since the last compaction
+    std::unordered_map<std::uint64_t, std::unordered_map<std::uint64_t, std::uint64_t>> last_sequence_; // sender -> instance -> highest sequence stored
+    std::unordered_map<std::uint64_t, std::unordered_map<std::uint64_t, read_state>> read_states_; // receiver -> sender
     std::string user_file_;
     std::string message_file_;
+    std::string sequence_file_;
+    std::string read_state_file_;
+    std::ofstream message_out_;    // append-only; compact() rewrites the file
+    std::ofstream sequence_out_;   // likewise
+    std::ofstream read_state_out_; // likewise
+    bool rewriting_ = false;       // rewrite_state_files is writing new logs
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> changed_sequences_;   // (sender, instance) since it started
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> changed_read_states_; // (receiver, sender) likewise
     mutable std::mutex mutex_;
+    std::mutex compaction_mutex_;
 };
 
 #endif // DATABASE_HPP
@@ -0,0 +1,74 @@
+//
+// frame_buffer.hpp
+// ~~~~~~~~~~~~~~~~
+
+
+#ifndef FRAME_BUFFER_HPP
+#define FRAME_BUFFER_HPP
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <boost/asio/buffer.hpp>
+#include "chat_message.hpp"
+
+// Per-connection read buffer. The socket reads as much as is available into
+// the free space at the tail, and complete frames are then taken off the front
+// one by one, so a burst of small frames costs a single read. The storage is
+// allocated once; leftover bytes of a partial frame are moved back to the
+// start when the tail runs out of room.
+class frame_buffer
+{
+public:
+    enum result { frame_ready, need_more, bad_frame };
+
+    explicit frame_buffer(std::size_t capacity)
+        : data_(std::max<std::size_t>(capacity, chat_message::max_frame_length)),
+          begin_(0), end_(0)
+    {
+    }
+
+    boost::asio::mutable_buffer prepare()
+    {
+        if (begin_ == end_)
+        {
+            begin_ = end_ = 0;
+        }
+        else if (data_.size() - begin_ < chat_message::max_frame_length)
+        {
+            std::memmove(data_.data(), data_.data() + begin_, end_ - begin_);
+            end_ -= begin_;
+            begin_ = 0;
+        }
+        return boost::asio::buffer(data_.data() + end_, data_.size() - end_);
+    }
+
+    void commit(std::size_t length)
+    {
+        end_ += length;
+    }
+
+    // Copies the next complete frame into msg and drops it from the buffer.
+    result next(chat_message& msg)
+    {
+        std::size_t available = end_ - begin_;
+        if (available < chat_message::header_length) return need_more;
+
+        std::memcpy(msg.data(), data_.data() + begin_, chat_message::header_length);
+        if (!msg.decode_header()) return bad_frame;
+
+        std::size_t length = msg.length();
+        if (available < length) return need_more;
+
+        std::memcpy(msg.body(), data_.data() + begin_ + chat_message::header_length, msg.body_length());
+        begin_ += length;
+        return frame_ready;
+    }
+
+private:
+    std::vector<char> data_;
+    std::size_t begin_;
+    std::size_t end_;
+};
+
+#endif // FRAME_BUFFER_HPP
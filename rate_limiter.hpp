@@ -0,0 +1,93 @@
+//
+// rate_limiter.hpp
+// ~~~~~~~~~~~~~~~~
+
+
+#ifndef RATE_LIMITER_HPP
+#define RATE_LIMITER_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+struct rate_limit {
+    double rate;  // tokens added per second, 0 disables the limit
+    double burst; // bucket capacity
+};
+
+class token_bucket {
+public:
+    using clock = std::chrono::steady_clock;
+
+    token_bucket()
+        : tokens_(-1.0) {
+    }
+
+    // Refills the bucket for the time elapsed since the last call and reports
+    // whether a token is available. A fresh bucket starts full.
+    bool has_token(const rate_limit& limit, clock::time_point now) {
+        if (limit.rate <= 0.0) return true;
+
+        if (tokens_ < 0.0) {
+            tokens_ = limit.burst;
+        }
+        else {
+            std::chrono::duration<double> elapsed = now - last_;
+            tokens_ = std::min(limit.burst, tokens_ + elapsed.count() * limit.rate);
+        }
+        last_ = now;
+        return tokens_ >= 1.0;
+    }
+
+    // Takes the token has_token() found.
+    void consume(const rate_limit& limit) {
+        if (limit.rate > 0.0) tokens_ -= 1.0;
+    }
+
+private:
+    double tokens_;
+    clock::time_point last_;
+};
+
+// Token buckets per user and per (user, command). Commands without a limit of
+// their own are only charged against the user's overall bucket.
+class rate_limiter {
+public:
+    struct user_limits {
+        token_bucket total;
+        std::unordered_map<std::string, token_bucket> commands;
+    };
+
+    rate_limiter(rate_limit per_user, std::unordered_map<std::string, rate_limit> per_command)
+        : per_user_(per_user), per_command_(std::move(per_command)) {
+    }
+
+    user_limits& limits_for(std::uint64_t user_id) {
+        return users_[user_id];
+    }
+
+    // A frame is charged only if every bucket it counts against has a token,
+    // so a rejected frame never uses up any of them.
+    bool allow(user_limits& limits, const std::string& command) {
+        auto now = token_bucket::clock::now();
+        auto it = per_command_.find(command);
+        token_bucket* command_bucket = it != per_command_.end() ? &limits.commands[command] : nullptr;
+
+        if (command_bucket && !command_bucket->has_token(it->second, now)) return false;
+        if (!limits.total.has_token(per_user_, now)) return false;
+
+        if (command_bucket) command_bucket->consume(it->second);
+        limits.total.consume(per_user_);
+        return true;
+    }
+
+private:
+    rate_limit per_user_;
+    std::unordered_map<std::string, rate_limit> per_command_;
+    std::unordered_map<std::uint64_t, user_limits> users_;
+};
+
+#endif // RATE_LIMITER_HPP
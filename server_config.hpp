@@ -0,0 +1,88 @@
+//
+// server_config.hpp
+// ~~~~~~~~~~~~~~~~~
+
+
+#ifndef SERVER_CONFIG_HPP
+#define SERVER_CONFIG_HPP
+
+#include <cstddef>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include "database.hpp"
+#include "rate_limiter.hpp"
+#include "socket_options.hpp"
+
+// Server settings, read from a plain text file with one "key value..." pair per
+// line. Lines starting with '#' and unknown keys are ignored, and a missing
+// file leaves every setting at its default.
+//
+//   user_limit 20 40          every frame from a user: 20/s, bursts of 40
+//   command_limit #S_M 5 10   additionally limit #S_M to 5/s, bursts of 10
+//   max_frames_per_turn 8     frames a session handles before yielding
+//   retention_max_age 0       drop messages older than this many seconds
+//   retention_max_messages 0  keep at most this many per conversation
+//   retention_max_bytes 0     cap the message file at about this size
+//   compaction_interval 300   seconds between background compactions
+// plus the per-connection keys described in socket_options.hpp.
+//
+// Retention limits of 0 are off. With all of them off no message is dropped,
+// but compaction still runs to rewrite the sequence and read state logs.
+struct server_config {
+    rate_limit user_limit{ 20.0, 40.0 };
+    std::unordered_map<std::string, rate_limit> command_limits{
+        { "#S_M", { 5.0, 10.0 } },
+        { "#R_M", { 2.0, 4.0 } },
+    };
+    std::size_t max_frames_per_turn = 8;
+    socket_options socket;
+    retention_policy retention;
+    std::size_t compaction_interval = 300;
+
+    static server_config load(const std::string& config_file) {
+        server_config config;
+        std::ifstream file(config_file);
+        if (!file.is_open()) return config;
+
+        std::string line;
+        while (std::getline(file, line)) {
+            std::istringstream fields(line);
+            std::string key;
+            if (!(fields >> key) || key.front() == '#') continue;
+
+            if (key == "user_limit") {
+                fields >> config.user_limit.rate >> config.user_limit.burst;
+            }
+            else if (key == "command_limit") {
+                std::string command;
+                rate_limit limit{};
+                if (fields >> command >> limit.rate >> limit.burst) {
+                    config.command_limits[command] = limit;
+                }
+            }
+            else if (key == "max_frames_per_turn") {
+                fields >> config.max_frames_per_turn;
+            }
+            else if (key == "retention_max_age") {
+                fields >> config.retention.max_age_seconds;
+            }
+            else if (key == "retention_max_messages") {
+                fields >> config.retention.max_messages_per_conversation;
+            }
+            else if (key == "retention_max_bytes") {
+                fields >> config.retention.max_total_bytes;
+            }
+            else if (key == "compaction_interval") {
+                fields >> config.compaction_interval;
+            }
+            else {
+                config.socket.parse(key, fields);
+            }
+        }
+        return config;
+    }
+};
+
+#endif // SERVER_CONFIG_HPP
@@ -0,0 +1,78 @@
+//
+// socket_options.hpp
+// ~~~~~~~~~~~~~~~~~~
+
+
+#ifndef SOCKET_OPTIONS_HPP
+#define SOCKET_OPTIONS_HPP
+
+#include <cstddef>
+#include <fstream>
+#include <istream>
+#include <sstream>
+#include <string>
+#include <boost/asio.hpp>
+
+// Per-connection socket settings. Buffer sizes of 0 keep the OS defaults.
+//
+//   tcp_nodelay 1             disable Nagle so small frames go out at once
+//   send_buffer_size 0        SO_SNDBUF
+//   receive_buffer_size 0     SO_RCVBUF
+//   read_buffer_size 8192     bytes read from the socket per read call
+struct socket_options {
+    bool tcp_nodelay = true;
+    int send_buffer_size = 0;
+    int receive_buffer_size = 0;
+    std::size_t read_buffer_size = 8192;
+
+    // Reads the value for key from fields; returns false for keys that are not
+    // socket options.
+    bool parse(const std::string& key, std::istream& fields) {
+        if (key == "tcp_nodelay") {
+            fields >> tcp_nodelay;
+        }
+        else if (key == "send_buffer_size") {
+            fields >> send_buffer_size;
+        }
+        else if (key == "receive_buffer_size") {
+            fields >> receive_buffer_size;
+        }
+        else if (key == "read_buffer_size") {
+            fields >> read_buffer_size;
+        }
+        else {
+            return false;
+        }
+        return true;
+    }
+
+    static socket_options load(const std::string& config_file) {
+        socket_options options;
+        std::ifstream file(config_file);
+        if (!file.is_open()) return options;
+
+        std::string line;
+        while (std::getline(file, line)) {
+            std::istringstream fields(line);
+            std::string key;
+            if (fields >> key) {
+                options.parse(key, fields);
+            }
+        }
+        return options;
+    }
+
+    // Failures are ignored: the connection still works with the OS defaults.
+    void apply(boost::asio::ip::tcp::socket& socket) const {
+        boost::system::error_code ec;
+        socket.set_option(boost::asio::ip::tcp::no_delay(tcp_nodelay), ec);
+        if (send_buffer_size > 0) {
+            socket.set_option(boost::asio::socket_base::send_buffer_size(send_buffer_size), ec);
+        }
+        if (receive_buffer_size > 0) {
+            socket.set_option(boost::asio::socket_base::receive_buffer_size(receive_buffer_size), ec);
+        }
+    }
+};
+
+#endif // SOCKET_OPTIONS_HPP